@@ -0,0 +1,308 @@
+/*
+    This file is part of ttymidi.
+
+    ttymidi is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    ttymidi is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with ttymidi.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "midiring.h"
+
+/* how often an idle reader checks that its writer is still alive */
+#define CHECK_INTERVAL_NS        100000000ULL
+
+static size_t ring_size(uint32_t capacity)
+{
+	return sizeof(midiring_t) + (size_t) capacity * sizeof(midiring_slot_t);
+}
+
+uint64_t midiring_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* --------------------------------------------------------------------- */
+// Writer
+
+/*
+ * Is another ttymidi already publishing under this name? A ring left
+ * behind by a writer that died without cleaning up does not count.
+ */
+static int writer_running(const char *name)
+{
+	const midiring_t *ring;
+	struct stat st;
+	int fd, pid = 0;
+
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0) return 0;
+
+	if (fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(midiring_t))
+	{
+		ring = mmap(NULL, sizeof(midiring_t), PROT_READ, MAP_SHARED, fd, 0);
+		if (ring != MAP_FAILED)
+		{
+			if (ring->magic == MIDIRING_MAGIC && ring->version == MIDIRING_VERSION)
+				pid = __atomic_load_n(&ring->writer_pid, __ATOMIC_ACQUIRE);
+			munmap((void *) ring, sizeof(midiring_t));
+		}
+	}
+	close(fd);
+
+	return pid > 0 && (kill(pid, 0) == 0 || errno == EPERM);
+}
+
+midiring_t *midiring_create(const char *name, uint32_t capacity)
+{
+	midiring_t *ring;
+	size_t size;
+	uint32_t i;
+	int fd;
+
+	/* round up to a power of two so slot lookup is a mask */
+	if (capacity < 2) capacity = 2;
+	if (capacity & (capacity - 1))
+	{
+		i = 1;
+		while (i < capacity && i < 0x80000000U) i <<= 1;
+		capacity = i;
+	}
+	size = ring_size(capacity);
+
+	if (writer_running(name))
+	{
+		errno = EBUSY;
+		return NULL;
+	}
+
+	/*
+	 * Never reuse an existing object in place: readers still attached to
+	 * it keep their (differently sized) mapping of the old ring.
+	 */
+	shm_unlink(name);
+	fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+	if (fd < 0) return NULL;
+
+	if (ftruncate(fd, size) < 0)
+	{
+		close(fd);
+		shm_unlink(name);
+		return NULL;
+	}
+
+	ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (ring == MAP_FAILED)
+	{
+		shm_unlink(name);
+		return NULL;
+	}
+
+	/* fresh object, already zero-filled; magic goes last */
+	ring->version   = MIDIRING_VERSION;
+	ring->capacity  = capacity;
+	ring->slot_size = sizeof(midiring_slot_t);
+	__atomic_store_n(&ring->writer_pid, getpid(), __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	ring->magic = MIDIRING_MAGIC;
+
+	return ring;
+}
+
+/*
+ * Only one thread may publish at a time; readers are never waited for.
+ */
+void midiring_publish(midiring_t *ring, const midiring_event_t *ev)
+{
+	uint64_t n = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	midiring_slot_t *slot = &ring->slots[n & (ring->capacity - 1)];
+
+	/* odd: slot is being rewritten, readers must not trust its contents */
+	__atomic_store_n(&slot->seq, 2*n + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	slot->event = *ev;
+
+	__atomic_store_n(&slot->seq, 2*n + 2, __ATOMIC_RELEASE);
+	__atomic_store_n(&ring->head, n + 1, __ATOMIC_RELEASE);
+}
+
+void midiring_destroy(midiring_t *ring, const char *name)
+{
+	/* tell readers to let go of this ring */
+	__atomic_store_n(&ring->writer_pid, 0, __ATOMIC_RELEASE);
+	munmap(ring, ring_size(ring->capacity));
+	shm_unlink(name);
+}
+
+/* --------------------------------------------------------------------- */
+// Reader
+
+int midiring_open(midiring_reader_t *reader, const char *name)
+{
+	const midiring_t *ring;
+	struct stat st;
+	int fd;
+
+	if (strlen(name) > MIDIRING_MAX_NAME)
+	{
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0) return -1;
+
+	if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(midiring_t))
+	{
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+
+	ring = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (ring == MAP_FAILED) return -1;
+
+	if (ring->magic != MIDIRING_MAGIC || ring->version != MIDIRING_VERSION ||
+	    ring->slot_size != sizeof(midiring_slot_t) ||
+	    ring_size(ring->capacity) > (size_t) st.st_size)
+	{
+		munmap((void *) ring, st.st_size);
+		errno = EPROTO;
+		return -1;
+	}
+
+	/* a ring whose writer has shut down is about to be unlinked */
+	if (__atomic_load_n(&ring->writer_pid, __ATOMIC_ACQUIRE) == 0)
+	{
+		munmap((void *) ring, st.st_size);
+		errno = ENOENT;
+		return -1;
+	}
+
+	reader->ring     = ring;
+	reader->map_size = st.st_size;
+	reader->capacity = ring->capacity;
+	reader->writer_pid = __atomic_load_n(&ring->writer_pid, __ATOMIC_ACQUIRE);
+	reader->dev      = st.st_dev;
+	reader->ino      = st.st_ino;
+	reader->next_check = midiring_now() + CHECK_INTERVAL_NS;
+	strcpy(reader->name, name);
+	reader->cursor   = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	reader->lost     = 0;
+
+	return 0;
+}
+
+/*
+ * Move the cursor back to the oldest event that is still safe to read.
+ * The slot the writer would fill next is left out, as it may be mid-update.
+ */
+void midiring_rewind(midiring_reader_t *reader)
+{
+	uint64_t head = __atomic_load_n(&reader->ring->head, __ATOMIC_ACQUIRE);
+	uint64_t span = reader->capacity - 1;
+
+	reader->cursor = head > span ? head - span : 0;
+}
+
+/*
+ * Has the writer gone away without clearing writer_pid (crash, SIGKILL),
+ * or has the name been taken over by a newer ring?
+ */
+static int writer_lost(const midiring_reader_t *reader, const char *name)
+{
+	struct stat st;
+	int fd, same;
+
+	if (kill(reader->writer_pid, 0) < 0 && errno == ESRCH) return 1;
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0) return 1;
+	same = fstat(fd, &st) == 0 && st.st_dev == reader->dev && st.st_ino == reader->ino;
+	close(fd);
+
+	return !same;
+}
+
+static int skip_overrun(midiring_reader_t *reader)
+{
+	uint64_t old = reader->cursor;
+
+	midiring_rewind(reader);
+	if (reader->cursor <= old)
+		reader->cursor = old + 1;
+	reader->lost += reader->cursor - old;
+
+	return MIDIRING_OVERRUN;
+}
+
+int midiring_next(midiring_reader_t *reader, midiring_event_t *ev)
+{
+	const midiring_t *ring = reader->ring;
+	const midiring_slot_t *slot;
+	uint64_t head, n, seq;
+
+	n    = reader->cursor;
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+	if (n == head)
+	{
+		/* head is re-checked so events published just before shutdown are not missed */
+		if (__atomic_load_n(&ring->writer_pid, __ATOMIC_ACQUIRE) == 0 &&
+		    __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == n)
+			return MIDIRING_CLOSED;
+
+		if (midiring_now() >= reader->next_check)
+		{
+			reader->next_check = midiring_now() + CHECK_INTERVAL_NS;
+			if (writer_lost(reader, reader->name) &&
+			    __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == n)
+				return MIDIRING_CLOSED;
+		}
+		return MIDIRING_EMPTY;
+	}
+	if (head - n >= reader->capacity) return skip_overrun(reader);
+
+	slot = &ring->slots[n & (reader->capacity - 1)];
+
+	seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+	if (seq != 2*n + 2) return skip_overrun(reader);
+
+	*ev = slot->event;
+
+	/* if the writer touched the slot while we copied it, the copy is torn */
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq)
+		return skip_overrun(reader);
+
+	reader->cursor = n + 1;
+	return MIDIRING_OK;
+}
+
+void midiring_close(midiring_reader_t *reader)
+{
+	munmap((void *) reader->ring, reader->map_size);
+	reader->ring = NULL;
+}
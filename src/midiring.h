@@ -0,0 +1,141 @@
+/*
+    This file is part of ttymidi.
+
+    ttymidi is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    ttymidi is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with ttymidi.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+   Shared-memory MIDI event ring.
+
+   ttymidi publishes every decoded event into a POSIX shared-memory object
+   (see shm_open(3)) laid out as a midiring_t. Any number of local readers
+   can map it read-only and follow it without locks and without going
+   through the ALSA sequencer:
+
+	midiring_reader_t r;
+	midiring_event_t ev;
+
+	if (midiring_open(&r, "/ttymidi") < 0) ...
+	for (;;)
+		switch (midiring_next(&r, &ev))
+		{
+			case MIDIRING_OK:      ... use ev ...;        break;
+			case MIDIRING_OVERRUN: ... r.lost went up ...; break;
+			case MIDIRING_EMPTY:   ... wait a bit ...;    break;
+			case MIDIRING_CLOSED:  ... close, reopen later ...; break;
+		}
+	midiring_close(&r);
+
+   The writer never waits for readers. Each slot carries a sequence number
+   that is odd while the slot is being rewritten and 2*n+2 once event n is
+   in it, so a reader that falls more than a ring's length behind notices
+   that its slot was reused, counts the events it missed and carries on
+   from the oldest event still available.
+
+   Each writer gets a fresh shared-memory object: the name is unlinked and
+   created anew, so readers of an earlier ring keep a valid mapping of it.
+   When the writer shuts down it clears writer_pid and midiring_next()
+   reports MIDIRING_CLOSED once the remaining events have been read; the
+   reader should then close the ring and open the name again. A writer
+   that died without cleaning up is noticed too: while the ring is idle,
+   midiring_next() checks every so often that the writer process still
+   exists and that the name still refers to the ring it has mapped.
+*/
+
+#ifndef MIDIRING_H
+#define MIDIRING_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MIDIRING_MAGIC           0x474e524d  /* "MRNG" */
+#define MIDIRING_VERSION         2
+#define MIDIRING_DEFAULT_SIZE    4096
+#define MIDIRING_MAX_NAME        255
+
+/* midiring_event_t.source */
+#define MIDIRING_FROM_SERIAL     0
+#define MIDIRING_FROM_ALSA       1
+
+/* midiring_next() results */
+#define MIDIRING_CLOSED         -2
+#define MIDIRING_OVERRUN        -1
+#define MIDIRING_EMPTY           0
+#define MIDIRING_OK              1
+
+typedef struct
+{
+	uint64_t timestamp;   // CLOCK_MONOTONIC, in nanoseconds
+	uint8_t  source;      // MIDIRING_FROM_*
+	uint8_t  size;        // number of valid bytes: 2 or 3
+	uint8_t  bytes[3];    // raw MIDI message, status byte first
+} midiring_event_t;
+
+/*
+ * seq, writer_pid and head are shared with another process and must only
+ * be accessed atomically (midiring.c uses the __atomic builtins); they are
+ * plain integers here so the header can be included from C++ as well.
+ */
+typedef struct
+{
+	uint64_t seq;
+	midiring_event_t event;
+} midiring_slot_t;
+
+typedef struct
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t capacity;    // number of slots, always a power of two
+	uint32_t slot_size;   // sizeof(midiring_slot_t), to catch ABI mismatches
+	int32_t  writer_pid;  // pid of the writing ttymidi, 0 once it has shut down
+	uint64_t head;        // number of events published so far
+	midiring_slot_t slots[];
+} midiring_t;
+
+typedef struct
+{
+	const midiring_t *ring;
+	size_t   map_size;
+	uint32_t capacity;    // copied at open time, never re-read from the ring
+	uint64_t cursor;      // index of the next event to read
+	uint64_t lost;        // events overwritten before this reader got to them
+	int32_t  writer_pid;  // writer seen at open time
+	uint64_t dev, ino;    // identity of the shared-memory object at open time
+	uint64_t next_check;  // when to next check the writer is still there
+	char     name[256];   // shared-memory name the ring was opened under
+} midiring_reader_t;
+
+/* writer side (ttymidi); midiring_publish() must not be called concurrently */
+midiring_t *midiring_create(const char *name, uint32_t capacity);
+void midiring_publish(midiring_t *ring, const midiring_event_t *ev);
+void midiring_destroy(midiring_t *ring, const char *name);
+
+/* reader side */
+int  midiring_open(midiring_reader_t *reader, const char *name);
+void midiring_rewind(midiring_reader_t *reader);
+int  midiring_next(midiring_reader_t *reader, midiring_event_t *ev);
+void midiring_close(midiring_reader_t *reader);
+
+uint64_t midiring_now(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,497 @@
+/*
+    This file is part of ttymidi.
+
+    ttymidi is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    ttymidi is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with ttymidi.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+   Measures the latency of a running ttymidi on the two ways it can pass
+   an event from one serial device on to another:
+
+   sequencer: ttymidi -s A, with its own "MIDI out" subscribed to its own
+              "MIDI in": serial A -> ALSA -> serial A
+   thru:      ttymidi -s A --thru B: serial A -> serial B
+
+   and from a serial device to an ALSA client, once with ttymidi sleeping
+   in read() and once with --busy-poll:
+
+   to ALSA:   ttymidi -s A, its "MIDI out" subscribed to by this program
+
+   Pseudo-terminals stand in for the serial devices, so no hardware (and no
+   wire time) is involved. Each note-on is timed from the moment its three
+   bytes are written to A until they can be read back from A or B, or until
+   snd_seq_event_input() hands it to us. The clock starts before ttymidi
+   has even been woken up, so unlike the figure ttymidi prints on exit
+   this includes the wakeup.
+
+   Anything after "--" is passed on to every ttymidi started, e.g.
+   -- --busy-cpu 3 --busy-sleep 0.
+*/
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <argp.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <alsa/asoundlib.h>
+
+#define MAX_DEV_STR_LEN               32
+#define MAX_EXTRA_ARGS                16
+#define TIMEOUT_MS                  1000
+
+/* --------------------------------------------------------------------- */
+// Program options
+
+static struct argp_option options[] =
+{
+	{"count"        , 'c', "N"   , 0, "Number of events to time per route. Default = 10000" },
+	{"ttymidi"      , 't', "PATH", 0, "ttymidi binary to run. Default = ./ttymidi" },
+	{ 0 }
+};
+
+typedef struct _arguments
+{
+	int   count;
+	char *ttymidi;
+	char *extra[MAX_EXTRA_ARGS];  // passed on to ttymidi
+	int   nextra;
+} arguments_t;
+
+static error_t parse_opt (int key, char *arg, struct argp_state *state)
+{
+	arguments_t *arguments = state->input;
+
+	switch (key)
+	{
+		case 'c':
+			if (arg == NULL) break;
+			arguments->count = strtol(arg, NULL, 0);
+			if (arguments->count <= 0) argp_error(state, "invalid count '%s'", arg);
+			break;
+		case 't':
+			if (arg == NULL) break;
+			arguments->ttymidi = arg;
+			break;
+
+		case ARGP_KEY_ARG:
+			if (arguments->nextra == MAX_EXTRA_ARGS) argp_error(state, "too many ttymidi options");
+			arguments->extra[arguments->nextra++] = arg;
+			break;
+		case ARGP_KEY_END:
+			break;
+
+		default:
+			return ARGP_ERR_UNKNOWN;
+	}
+
+	return 0;
+}
+
+const char *argp_program_version     = "ttymidi-bench 0.60";
+const char *argp_program_bug_address = "tvst@hotmail.com";
+static char args_doc[]  = "[-- TTYMIDI-OPTIONS]";
+static char doc[]       = "ttymidi-bench - Measure ttymidi's serial thru latency against the ALSA sequencer route";
+static struct argp argp = { options, parse_opt, args_doc, doc };
+arguments_t arguments;
+
+typedef struct
+{
+	int  master;                  // our end, stands in for the device
+	char slave[64];               // ttymidi's end, passed as -s / --thru
+} pty_t;
+
+/* --------------------------------------------------------------------- */
+// Helpers
+
+uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void open_pty(pty_t *pty)
+{
+	struct termios tio;
+
+	pty->master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (pty->master < 0 || grantpt(pty->master) < 0 || unlockpt(pty->master) < 0)
+	{
+		perror("posix_openpt");
+		exit(1);
+	}
+	strncpy(pty->slave, ptsname(pty->master), sizeof(pty->slave) - 1);
+
+	/* raw, like ttymidi's serial settings */
+	tcgetattr(pty->master, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(pty->master, TCSANOW, &tio);
+}
+
+/* read exactly size bytes, or give up after TIMEOUT_MS */
+int read_back(int fd, char *bytes, int size)
+{
+	struct pollfd pfd = { fd, POLLIN, 0 };
+	int n = 0, r;
+
+	while (n < size)
+	{
+		if (poll(&pfd, 1, TIMEOUT_MS) <= 0) return -1;
+		r = read(fd, bytes + n, size - n);
+		if (r <= 0) return -1;
+		n += r;
+	}
+
+	return 0;
+}
+
+/* wait for the next note-on sent to our ALSA port, or give up after TIMEOUT_MS */
+int read_back_alsa(snd_seq_t* seq)
+{
+	snd_seq_event_t *ev;
+	struct pollfd pfd[4];
+	int npfd;
+
+	npfd = snd_seq_poll_descriptors(seq, pfd, 4, POLLIN);
+	for (;;)
+	{
+		if (snd_seq_event_input_pending(seq, 1) <= 0 && poll(pfd, npfd, TIMEOUT_MS) <= 0) return -1;
+		if (snd_seq_event_input(seq, &ev) >= 0 && ev->type == SND_SEQ_EVENT_NOTEON) return 0;
+	}
+}
+
+/* throw away anything still queued, e.g. late answers to start-up probes */
+void drain(int fd, snd_seq_t* seq)
+{
+	struct pollfd pfd = { fd, POLLIN, 0 };
+	char junk[64];
+
+	if (fd < 0)
+	{
+		while (read_back_alsa(seq) == 0);
+		return;
+	}
+	while (poll(&pfd, 1, 100) > 0 && read(fd, junk, sizeof(junk)) > 0);
+}
+
+/*
+ * One note-on from `from` until it can be read from `to`, or from our ALSA
+ * port if `to` is -1, in ns; 0 on timeout.
+ */
+uint64_t roundtrip(int from, int to, snd_seq_t* seq, int note)
+{
+	char buf[3] = { 0x90, note & 0x7F, 100 }, back[3];
+	uint64_t t0 = now_ns();
+
+	if (write(from, buf, 3) != 3) return 0;
+	if (to < 0 ? read_back_alsa(seq) < 0 : read_back(to, back, 3) < 0) return 0;
+	return now_ns() - t0;
+}
+
+/* ttymidi is ready once a probe makes it through */
+int wait_ready(int from, int to, snd_seq_t* seq)
+{
+	int i;
+
+	for (i = 0; i < 20; i++)
+		if (roundtrip(from, to, seq, 0) > 0)
+		{
+			drain(to, seq);
+			return 0;
+		}
+
+	return -1;
+}
+
+int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+	return x < y ? -1 : x > y;
+}
+
+uint64_t report(const char *route, uint64_t *samples, int count)
+{
+	uint64_t sum = 0;
+	int i;
+
+	qsort(samples, count, sizeof(uint64_t), compare_u64);
+	for (i = 0; i < count; i++) sum += samples[i];
+
+	printf("%-20s min %8.1f  avg %8.1f  median %8.1f  p99 %8.1f  max %8.1f us\n", route,
+		samples[0] / 1000.0, sum / (double) count / 1000.0, samples[count / 2] / 1000.0,
+		samples[count * 99 / 100] / 1000.0, samples[count - 1] / 1000.0);
+
+	return samples[count / 2];
+}
+
+/* --------------------------------------------------------------------- */
+// ttymidi under test
+
+pid_t start_ttymidi(const char *client, pty_t *serial, pty_t *thru, int busy_poll)
+{
+	char *argv[13 + MAX_EXTRA_ARGS];
+	int argc = 0, i, devnull;
+	pid_t pid;
+
+	argv[argc++] = arguments.ttymidi;
+	argv[argc++] = "-q";
+	argv[argc++] = "-n";
+	argv[argc++] = (char *) client;
+	argv[argc++] = "-s";
+	argv[argc++] = serial->slave;
+	if (thru != NULL)
+	{
+		argv[argc++] = "--thru";
+		argv[argc++] = thru->slave;
+	}
+	if (busy_poll) argv[argc++] = "--busy-poll";
+	for (i = 0; i < arguments.nextra; i++)
+		argv[argc++] = arguments.extra[i];
+	argv[argc] = NULL;
+
+	pid = fork();
+	if (pid < 0)
+	{
+		perror("fork");
+		exit(1);
+	}
+	if (pid == 0)
+	{
+		devnull = open("/dev/null", O_WRONLY);
+		dup2(devnull, STDOUT_FILENO);
+		execv(argv[0], argv);
+		perror(argv[0]);
+		_exit(127);
+	}
+
+	return pid;
+}
+
+void stop_ttymidi(pid_t pid)
+{
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+}
+
+/* find a port of the named client; returns the client id, or -1 */
+int find_port(snd_seq_t* seq, const char *client, const char *port, int *port_id)
+{
+	snd_seq_client_info_t *cinfo;
+	snd_seq_port_info_t *pinfo;
+
+	snd_seq_client_info_alloca(&cinfo);
+	snd_seq_port_info_alloca(&pinfo);
+
+	snd_seq_client_info_set_client(cinfo, -1);
+	while (snd_seq_query_next_client(seq, cinfo) >= 0)
+	{
+		if (strcmp(snd_seq_client_info_get_name(cinfo), client) != 0) continue;
+
+		snd_seq_port_info_set_client(pinfo, snd_seq_client_info_get_client(cinfo));
+		snd_seq_port_info_set_port(pinfo, -1);
+		while (snd_seq_query_next_port(seq, pinfo) >= 0)
+			if (strcmp(snd_seq_port_info_get_name(pinfo), port) == 0)
+			{
+				*port_id = snd_seq_port_info_get_port(pinfo);
+				return snd_seq_client_info_get_client(cinfo);
+			}
+	}
+
+	return -1;
+}
+
+/* subscribe ttymidi's own "MIDI out" to its own "MIDI in" */
+int loop_back(snd_seq_t* seq, const char *client)
+{
+	snd_seq_port_subscribe_t *sub;
+	snd_seq_addr_t sender, dest;
+	int i, c1 = -1, c2 = -1, out_port, in_port;
+
+	/* the client shows up a little after ttymidi starts */
+	for (i = 0; i < 50 && (c1 < 0 || c2 < 0); i++)
+	{
+		c1 = find_port(seq, client, "MIDI out", &out_port);
+		c2 = find_port(seq, client, "MIDI in", &in_port);
+		if (c1 < 0 || c2 < 0) usleep(100000);
+	}
+	if (c1 < 0 || c2 < 0) return -1;
+
+	sender.client = c1;
+	sender.port   = out_port;
+	dest.client   = c2;
+	dest.port     = in_port;
+
+	snd_seq_port_subscribe_alloca(&sub);
+	snd_seq_port_subscribe_set_sender(sub, &sender);
+	snd_seq_port_subscribe_set_dest(sub, &dest);
+
+	return snd_seq_subscribe_port(seq, sub);
+}
+
+/* --------------------------------------------------------------------- */
+// Routes
+
+/* times count events from `from` to `to`; returns the median, 0 on failure */
+uint64_t bench(const char *route, int from, int to, snd_seq_t* seq, uint64_t *samples)
+{
+	int i;
+
+	if (wait_ready(from, to, seq) < 0)
+	{
+		fprintf(stderr, "%s: ttymidi did not pass any events on.\n", route);
+		return 0;
+	}
+
+	for (i = 0; i < arguments.count; i++)
+		if ((samples[i] = roundtrip(from, to, seq, i)) == 0)
+		{
+			fprintf(stderr, "%s: event %i was lost.\n", route, i);
+			return 0;
+		}
+
+	return report(route, samples, arguments.count);
+}
+
+uint64_t bench_sequencer(snd_seq_t* seq, uint64_t *samples)
+{
+	char client[MAX_DEV_STR_LEN];
+	uint64_t median = 0;
+	pty_t serial;
+	pid_t pid;
+
+	snprintf(client, sizeof(client), "ttymidi-bench-%i", (int) getpid());
+	open_pty(&serial);
+	pid = start_ttymidi(client, &serial, NULL, 0);
+
+	if (loop_back(seq, client) < 0)
+		fprintf(stderr, "sequencer: could not connect %s's MIDI out to its MIDI in.\n", client);
+	else
+		median = bench("sequencer", serial.master, serial.master, NULL, samples);
+
+	stop_ttymidi(pid);
+	close(serial.master);
+	return median;
+}
+
+uint64_t bench_thru(uint64_t *samples)
+{
+	char client[MAX_DEV_STR_LEN];
+	uint64_t median;
+	pty_t serial, thru;
+	pid_t pid;
+
+	snprintf(client, sizeof(client), "ttymidi-bench-%i", (int) getpid());
+	open_pty(&serial);
+	open_pty(&thru);
+	pid = start_ttymidi(client, &serial, &thru, 0);
+
+	median = bench("thru", serial.master, thru.master, NULL, samples);
+
+	stop_ttymidi(pid);
+	close(serial.master);
+	close(thru.master);
+	return median;
+}
+
+/* serial A -> our own ALSA port, subscribed to ttymidi's "MIDI out" */
+uint64_t bench_to_alsa(snd_seq_t* seq, int port, int busy_poll, uint64_t *samples)
+{
+	char client[MAX_DEV_STR_LEN];
+	const char *route = busy_poll ? "to ALSA (busy-poll)" : "to ALSA (blocking)";
+	uint64_t median = 0;
+	int i, c = -1, out_port;
+	pty_t serial;
+	pid_t pid;
+
+	snprintf(client, sizeof(client), "ttymidi-bench-%i", (int) getpid());
+	open_pty(&serial);
+	pid = start_ttymidi(client, &serial, NULL, busy_poll);
+
+	for (i = 0; i < 50 && c < 0; i++)
+		if ((c = find_port(seq, client, "MIDI out", &out_port)) < 0) usleep(100000);
+
+	if (c < 0 || snd_seq_connect_from(seq, port, c, out_port) < 0)
+		fprintf(stderr, "%s: could not subscribe to %s's MIDI out.\n", route, client);
+	else
+		median = bench(route, serial.master, -1, seq, samples);
+
+	stop_ttymidi(pid);
+	close(serial.master);
+	return median;
+}
+
+/* --------------------------------------------------------------------- */
+// Main program
+
+int main(int argc, char** argv)
+{
+	snd_seq_t *seq;
+	uint64_t *samples, median_seq, median_thru, median_blocking, median_busy;
+	int port;
+
+	arguments.count   = 10000;
+	arguments.ttymidi = "./ttymidi";
+	arguments.nextra  = 0;
+	argp_parse(&argp, argc, argv, 0, 0, &arguments);
+
+	samples = malloc(arguments.count * sizeof(uint64_t));
+	if (samples == NULL)
+	{
+		perror("malloc");
+		exit(1);
+	}
+
+	/* sets up the loopback subscription, and receives the "to ALSA" routes */
+	if (snd_seq_open(&seq, "default", SND_SEQ_OPEN_DUPLEX, 0) < 0)
+	{
+		fprintf(stderr, "Error opening ALSA sequencer.\n");
+		exit(1);
+	}
+	snd_seq_set_client_name(seq, "ttymidi-bench");
+	port = snd_seq_create_simple_port(seq, "MIDI in",
+		SND_SEQ_PORT_CAP_WRITE|SND_SEQ_PORT_CAP_SUBS_WRITE,
+		SND_SEQ_PORT_TYPE_APPLICATION);
+	if (port < 0)
+	{
+		fprintf(stderr, "Error creating sequencer port.\n");
+		exit(1);
+	}
+
+	printf("Timing %i events per route through %s, from the pty write:\n", arguments.count, arguments.ttymidi);
+	fflush(stdout);
+
+	median_seq      = bench_sequencer(seq, samples);
+	median_thru     = bench_thru(samples);
+	median_blocking = bench_to_alsa(seq, port, 0, samples);
+	median_busy     = bench_to_alsa(seq, port, 1, samples);
+
+	if (median_seq && median_thru)
+		printf("thru saves %.1f us per event (median)\n", ((double) median_seq - (double) median_thru) / 1000.0);
+	if (median_blocking && median_busy)
+		printf("busy-poll saves %.1f us per event to ALSA (median)\n", ((double) median_blocking - (double) median_busy) / 1000.0);
+
+	snd_seq_close(seq);
+	free(samples);
+
+	return median_seq && median_thru && median_blocking && median_busy ? 0 : 1;
+}
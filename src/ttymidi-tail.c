@@ -0,0 +1,181 @@
+/*
+    This file is part of ttymidi.
+
+    ttymidi is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    ttymidi is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with ttymidi.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <argp.h>
+#include <signal.h>
+#include <time.h>
+#include "midiring.h"
+
+#define FALSE                         0
+#define TRUE                          1
+
+#define MAX_DEV_STR_LEN               32
+
+volatile sig_atomic_t run;
+
+/* --------------------------------------------------------------------- */
+// Program options
+
+static struct argp_option options[] =
+{
+	{"shm"          , 'm', "NAME", 0, "Shared-memory ring to follow. Default = /ttymidi" },
+	{"all"          , 'a', 0     , 0, "Start with the oldest event still in the ring instead of the newest" },
+	{"interval"     , 'i', "USEC", 0, "Time to sleep when no new event is available. Default = 1000" },
+	{ 0 }
+};
+
+typedef struct _arguments
+{
+	int  all, interval;
+	char shm[MAX_DEV_STR_LEN];
+} arguments_t;
+
+void exit_cli(int sig)
+{
+	run = FALSE;
+}
+
+static error_t parse_opt (int key, char *arg, struct argp_state *state)
+{
+	arguments_t *arguments = state->input;
+
+	switch (key)
+	{
+		case 'a':
+			arguments->all = 1;
+			break;
+		case 'm':
+			if (arg == NULL) break;
+			strncpy(arguments->shm, arg, MAX_DEV_STR_LEN - 1);
+			break;
+		case 'i':
+			if (arg == NULL) break;
+			arguments->interval = strtol(arg, NULL, 0);
+			if (arguments->interval < 0) argp_error(state, "invalid interval '%s'", arg);
+			break;
+
+		case ARGP_KEY_ARG:
+		case ARGP_KEY_END:
+			break;
+
+		default:
+			return ARGP_ERR_UNKNOWN;
+	}
+
+	return 0;
+}
+
+void arg_set_defaults(arguments_t *arguments)
+{
+	memset(arguments, 0, sizeof(*arguments));
+	arguments->interval = 1000;
+	strncpy(arguments->shm, "/ttymidi", MAX_DEV_STR_LEN - 1);
+}
+
+const char *argp_program_version     = "ttymidi-tail 0.60";
+const char *argp_program_bug_address = "tvst@hotmail.com";
+static char doc[]       = "ttymidi-tail - Follow the events ttymidi publishes in shared memory";
+static struct argp argp = { options, parse_opt, 0, doc };
+arguments_t arguments;
+
+/* --------------------------------------------------------------------- */
+// Main program
+
+void print_event(const midiring_event_t *ev)
+{
+	static const char *names[] = {
+		"Note off          ", "Note on           ", "Pressure change   ", "Controller change ",
+		"Program change    ", "Channel change    ", "Pitch bend        ", "System            "
+	};
+	int operation = ev->bytes[0] & 0xF0;
+	int channel   = ev->bytes[0] & 0x0F;
+
+	printf("%llu.%09llu %s 0x%x %s %03u %03u",
+		(unsigned long long) (ev->timestamp / 1000000000ULL),
+		(unsigned long long) (ev->timestamp % 1000000000ULL),
+		ev->source == MIDIRING_FROM_ALSA ? "Alsa  " : "Serial",
+		operation, names[(operation >> 4) & 0x7], channel, ev->bytes[1]);
+	if (ev->size > 2) printf(" %03u", ev->bytes[2]);
+	putchar('\n');
+}
+
+int main(int argc, char** argv)
+{
+	midiring_reader_t reader;
+	midiring_event_t ev;
+	struct timespec idle, retry = { 0, 100000000 };
+	uint64_t lost = 0;
+
+	arg_set_defaults(&arguments);
+	argp_parse(&argp, argc, argv, 0, 0, &arguments);
+
+	if (midiring_open(&reader, arguments.shm) < 0)
+	{
+		perror(arguments.shm);
+		exit(1);
+	}
+
+	if (arguments.all) midiring_rewind(&reader);
+
+	idle.tv_sec  = arguments.interval / 1000000;
+	idle.tv_nsec = (arguments.interval % 1000000) * 1000;
+
+	run = TRUE;
+	signal(SIGINT, exit_cli);
+	signal(SIGTERM, exit_cli);
+
+	while (run)
+	{
+		switch (midiring_next(&reader, &ev))
+		{
+			case MIDIRING_OK:
+				print_event(&ev);
+				break;
+
+			case MIDIRING_OVERRUN:
+				printf("*** overrun: %llu events lost\n", (unsigned long long) (reader.lost - lost));
+				lost = reader.lost;
+				break;
+
+			case MIDIRING_EMPTY:
+				fflush(stdout);
+				nanosleep(&idle, NULL);
+				break;
+
+			case MIDIRING_CLOSED:
+				/* ttymidi went away: wait for it to come back with a new ring */
+				printf("*** %s closed, waiting for ttymidi to restart\n", arguments.shm);
+				fflush(stdout);
+				midiring_close(&reader);
+				while (run && midiring_open(&reader, arguments.shm) < 0)
+					nanosleep(&retry, NULL);
+				if (!run) return 0;
+
+				/* everything in the new ring is news to us */
+				midiring_rewind(&reader);
+				lost = 0;
+				break;
+		}
+	}
+
+	midiring_close(&reader);
+	return 0;
+}
@@ -16,7 +16,13 @@
 */
 
 
+#define _GNU_SOURCE   /* pthread_setaffinity_np() */
 #include <stdlib.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -31,19 +37,71 @@
 #include <linux/serial.h>
 #include <linux/ioctl.h>
 #include <asm/ioctls.h>
+#include "midiring.h"
 
 #define FALSE                         0
 #define TRUE                          1
 
 #define MAX_DEV_STR_LEN               32
 #define MAX_MSG_SIZE                1024
+#define MAX_OUTPUT_RETRIES        100000
+
+/* long-only option keys (outside the printable range used by short options) */
+#define OPT_POOL_OUTPUT              256
+#define OPT_INPUT_BUFFER             257
+#define OPT_OUTPUT_BUFFER            258
+#define OPT_SHM                      259
+#define OPT_SHM_SIZE                 260
+#define OPT_CHANNEL_PORTS            261
+#define OPT_THRU                     262
+#define OPT_THRU_CHANNELS            263
+#define OPT_THRU_TYPES               264
+#define OPT_THRU_ALSA                265
+#define OPT_BUSY_POLL                266
+#define OPT_BUSY_CPU                 267
+#define OPT_BUSY_SPIN                268
+#define OPT_BUSY_SLEEP               269
+#define OPT_POOL_INPUT               270
+
+#define MIDI_CHANNELS                 16
 
 /* change this definition for the correct port */
 //#define _POSIX_SOURCE 1 /* POSIX compliant source */
 
 int run;
 int serial;
-int port_out_id;
+
+/* 
+ * ALSA ports, one in/out pair per channel group. Without --channel-ports
+ * there is a single group holding all 16 channels.
+ */
+int ngroups;
+int channel_group[MIDI_CHANNELS];  // channel -> group
+int group_first[MIDI_CHANNELS];    // group -> lowest channel in it
+int group_mask[MIDI_CHANNELS];     // group -> bit mask of its channels
+int port_out_ids[MIDI_CHANNELS];   // group -> "MIDI out" port
+int port_in_ids[MIDI_CHANNELS];    // group -> "MIDI in" port
+
+/* serial-to-serial thru: events from serial that pass the filter go here */
+int thru_serial = -1;
+unsigned long thru_forwarded;
+unsigned long thru_dropped;
+
+/* 
+ * Time from reading the last byte of a serial MIDI message to having
+ * handed it to ALSA, in nanoseconds. Only touched by the serial thread.
+ */
+uint64_t serial_decoded;
+unsigned long latency_count;
+uint64_t latency_sum, latency_max;
+
+/* sequencer error accounting, reported on shutdown */
+unsigned long alsa_overruns;
+unsigned long alsa_dropped;
+
+/* optional shared-memory ring, both MIDI threads publish into it */
+midiring_t *ring;
+pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /* --------------------------------------------------------------------- */
 // Program options
@@ -56,6 +114,21 @@ static struct argp_option options[] =
 	{"printonly"    , 'p', 0     , 0, "Super debugging: Print values read from serial -- and do nothing else" },
 	{"quiet"        , 'q', 0     , 0, "Don't produce any output, even when the print command is sent" },
 	{"name"		, 'n', "NAME", 0, "Name of the Alsa MIDI client. Default = ttymidi" },
+	{"pool-input"   , OPT_POOL_INPUT   , "N"    , 0, "Size of the ALSA client input pool (kernel FIFO), in events. Default = libasound default" },
+	{"pool-output"  , OPT_POOL_OUTPUT  , "N"    , 0, "Size of the ALSA client output pool, in events. Default = libasound default" },
+	{"input-buffer" , OPT_INPUT_BUFFER , "BYTES", 0, "Size of the ALSA sequencer input buffer. Default = libasound default" },
+	{"output-buffer", OPT_OUTPUT_BUFFER, "BYTES", 0, "Size of the ALSA sequencer output buffer. Default = libasound default" },
+	{"shm"          , OPT_SHM          , "NAME" , 0, "Also publish all events to the shared-memory ring NAME (e.g. /ttymidi)" },
+	{"shm-size"     , OPT_SHM_SIZE     , "N"    , 0, "Number of events kept in the shared-memory ring. Default = 4096" },
+	{"channel-ports", OPT_CHANNEL_PORTS, "GROUPS", OPTION_ARG_OPTIONAL, "Create a separate ALSA in/out port per MIDI channel, or per channel group given as e.g. 1-9,10,11-16" },
+	{"thru"         , OPT_THRU         , "DEV"  , 0, "Forward MIDI events read from the serial device straight to serial device DEV, bypassing ALSA" },
+	{"thru-channels", OPT_THRU_CHANNELS, "LIST" , 0, "Only forward these channels to the thru device, e.g. 1-4,10. Default = all" },
+	{"thru-types"   , OPT_THRU_TYPES   , "LIST" , 0, "Only forward these event types to the thru device: noteoff,noteon,keypress,cc,program,chanpress,pitchbend. Default = all" },
+	{"thru-alsa"    , OPT_THRU_ALSA    , 0      , 0, "Also send forwarded events to ALSA" },
+	{"busy-poll"    , OPT_BUSY_POLL    , 0      , 0, "Serve serial and ALSA from one thread that spins on non-blocking reads instead of sleeping" },
+	{"busy-cpu"     , OPT_BUSY_CPU     , "CPU"  , 0, "Pin the busy-poll thread to this CPU. Default = not pinned" },
+	{"busy-spin"    , OPT_BUSY_SPIN    , "N"    , 0, "Idle polls before the busy-poll thread starts sleeping. Default = 100000" },
+	{"busy-sleep"   , OPT_BUSY_SLEEP   , "USEC" , 0, "Longest sleep between idle polls, 0 = never sleep. Default = 1000" },
 	{ 0 }
 };
 
@@ -65,6 +138,14 @@ typedef struct _arguments
 	char serialdevice[MAX_DEV_STR_LEN];
 	int  baudrate;
 	char name[MAX_DEV_STR_LEN];
+	int  pool_input, pool_output, input_buffer, output_buffer; // 0 = keep libasound default
+	char shm[MAX_DEV_STR_LEN];                      // empty = no shared-memory ring
+	int  shm_size;
+	int  ngroups;                                   // 0 = single in/out port pair
+	int  channel_groups[MIDI_CHANNELS];             // bit mask of channels per group
+	char thru[MAX_DEV_STR_LEN];                     // empty = no thru device
+	int  thru_channels, thru_types, thru_alsa;      // channel / status nibble bit masks
+	int  busy_poll, busy_cpu, busy_spin, busy_sleep; // busy_cpu < 0 = not pinned
 } arguments_t;
 
 void exit_cli(int sig)
@@ -73,12 +154,91 @@ void exit_cli(int sig)
 	printf("\rttymidi closing down ... ");
 }
 
+/*
+ * Parse a channel list such as "1-9,10,11-16" into one bit mask per
+ * entry. Returns the mask of all listed channels, or -1 on error.
+ */
+static int parse_channel_list(const char *spec, int *masks, int *count)
+{
+	int first, last, used = 0, n = 0;
+	char *end;
+
+	while (*spec)
+	{
+		first = last = strtol(spec, &end, 10);
+		if (end == spec) return -1;
+		if (*end == '-')
+		{
+			spec = end + 1;
+			last = strtol(spec, &end, 10);
+			if (end == spec) return -1;
+		}
+		if (first < 1 || last > MIDI_CHANNELS || first > last) return -1;
+
+		int mask = ((1 << last) - 1) & ~((1 << (first - 1)) - 1);
+		if (mask & used) return -1; // overlapping entries
+		used |= mask;
+		masks[n++] = mask;
+
+		if (*end == ',') end++;
+		else if (*end != 0) return -1;
+		spec = end;
+	}
+
+	*count = n;
+	return n > 0 ? used : -1;
+}
+
+/*
+ * Channels that are not listed end up together in one extra group.
+ */
+static int parse_channel_groups(const char *spec, arguments_t *arguments)
+{
+	int used, n;
+
+	if ((used = parse_channel_list(spec, arguments->channel_groups, &n)) < 0)
+		return -1;
+
+	if (used != (1 << MIDI_CHANNELS) - 1)
+		arguments->channel_groups[n++] = ~used & ((1 << MIDI_CHANNELS) - 1);
+
+	arguments->ngroups = n;
+	return 0;
+}
+
+/*
+ * Parse a comma separated list of event type names into a mask of
+ * status nibbles (bit 8 = note off ... bit 14 = pitch bend).
+ */
+static int parse_event_types(const char *spec)
+{
+	static const char *names[] = { "noteoff", "noteon", "keypress", "cc", "program", "chanpress", "pitchbend" };
+	int i, len, mask = 0;
+
+	while (*spec)
+	{
+		len = strcspn(spec, ",");
+		for (i = 0; i < 7; i++)
+			if (strlen(names[i]) == len && strncmp(spec, names[i], len) == 0) break;
+		if (i == 7) return -1;
+
+		mask |= 1 << (i + 8);
+		spec += len;
+		if (*spec == ',') spec++;
+	}
+
+	return mask;
+}
+
 static error_t parse_opt (int key, char *arg, struct argp_state *state)
 {
 	/* Get the input argument from argp_parse, which we
 	   know is a pointer to our arguments structure. */
 	arguments_t *arguments = state->input;
 	int baud_temp;
+	long size_temp;
+	char *end;
+	int i, masks[MIDI_CHANNELS];
 
 	switch (key)
 	{
@@ -99,6 +259,67 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state)
 			if (arg == NULL) break;
 			strncpy(arguments->name, arg, MAX_DEV_STR_LEN);
 			break;
+		case OPT_POOL_INPUT:
+		case OPT_POOL_OUTPUT:
+		case OPT_INPUT_BUFFER:
+		case OPT_OUTPUT_BUFFER:
+		case OPT_SHM_SIZE:
+			if (arg == NULL) break;
+			size_temp = strtol(arg, &end, 0);
+			if (*end != 0 || size_temp <= 0 || size_temp > INT_MAX)
+				argp_error(state, "invalid size '%s'", arg);
+			if (key == OPT_POOL_INPUT)        arguments->pool_input    = size_temp;
+			else if (key == OPT_POOL_OUTPUT)  arguments->pool_output   = size_temp;
+			else if (key == OPT_INPUT_BUFFER) arguments->input_buffer  = size_temp;
+			else if (key == OPT_SHM_SIZE)     arguments->shm_size      = size_temp;
+			else                              arguments->output_buffer = size_temp;
+			break;
+		case OPT_SHM:
+			if (arg == NULL) break;
+			if (arg[0] != '/') argp_error(state, "shared-memory name '%s' must start with '/'", arg);
+			strncpy(arguments->shm, arg, MAX_DEV_STR_LEN - 1);
+			break;
+		case OPT_CHANNEL_PORTS:
+			if (arg == NULL)
+			{
+				for (i = 0; i < MIDI_CHANNELS; i++)
+					arguments->channel_groups[i] = 1 << i;
+				arguments->ngroups = MIDI_CHANNELS;
+			}
+			else if (parse_channel_groups(arg, arguments) < 0)
+				argp_error(state, "invalid channel groups '%s'", arg);
+			break;
+		case OPT_THRU:
+			if (arg == NULL) break;
+			strncpy(arguments->thru, arg, MAX_DEV_STR_LEN - 1);
+			break;
+		case OPT_THRU_CHANNELS:
+			if (arg == NULL) break;
+			if ((arguments->thru_channels = parse_channel_list(arg, masks, &i)) < 0)
+				argp_error(state, "invalid channel list '%s'", arg);
+			break;
+		case OPT_THRU_TYPES:
+			if (arg == NULL) break;
+			if ((arguments->thru_types = parse_event_types(arg)) <= 0)
+				argp_error(state, "invalid event types '%s'", arg);
+			break;
+		case OPT_THRU_ALSA:
+			arguments->thru_alsa = 1;
+			break;
+		case OPT_BUSY_POLL:
+			arguments->busy_poll = 1;
+			break;
+		case OPT_BUSY_CPU:
+		case OPT_BUSY_SPIN:
+		case OPT_BUSY_SLEEP:
+			if (arg == NULL) break;
+			size_temp = strtol(arg, &end, 0);
+			if (*end != 0 || size_temp < 0 || size_temp > INT_MAX)
+				argp_error(state, "invalid value '%s'", arg);
+			if (key == OPT_BUSY_CPU)       arguments->busy_cpu   = size_temp;
+			else if (key == OPT_BUSY_SPIN) arguments->busy_spin  = size_temp;
+			else                           arguments->busy_sleep = size_temp;
+			break;
 		case 'b':
 			if (arg == NULL) break;
 			baud_temp = strtol(arg, NULL, 0);
@@ -134,6 +355,21 @@ void arg_set_defaults(arguments_t *arguments)
 	arguments->silent       = 0;
 	arguments->verbose      = 0;
 	arguments->baudrate     = B115200;
+	arguments->pool_input   = 0;
+	arguments->pool_output  = 0;
+	arguments->input_buffer = 0;
+	arguments->output_buffer = 0;
+	arguments->shm[0]       = 0;
+	arguments->shm_size     = MIDIRING_DEFAULT_SIZE;
+	arguments->ngroups      = 0;
+	arguments->thru[0]      = 0;
+	arguments->thru_channels = 0xFFFF;
+	arguments->thru_types   = 0x7F00;
+	arguments->thru_alsa    = 0;
+	arguments->busy_poll    = 0;
+	arguments->busy_cpu     = -1;
+	arguments->busy_spin    = 100000;
+	arguments->busy_sleep   = 1000;
 	char *name_tmp		= (char *)"ttymidi";
 	strncpy(arguments->serialdevice, serialdevice_temp, MAX_DEV_STR_LEN);
 	strncpy(arguments->name, name_tmp, MAX_DEV_STR_LEN);
@@ -150,9 +386,29 @@ arguments_t arguments;
 /* --------------------------------------------------------------------- */
 // MIDI stuff
 
-int open_seq(snd_seq_t** seq) 
+/*
+ * Port name suffix for a group, e.g. " ch 10", " ch 1-4" or " ch 1,5-7".
+ */
+void group_port_suffix(int mask, char *name)
 {
-	int port_out_id, port_in_id; // actually port_in_id is not needed nor used anywhere
+	int ch, last;
+
+	name += sprintf(name, " ch");
+	for (ch = 0; ch < MIDI_CHANNELS; ch++)
+	{
+		if (!(mask & (1 << ch))) continue;
+		for (last = ch; last + 1 < MIDI_CHANNELS && (mask & (1 << (last + 1))); last++);
+		name += sprintf(name, "%c%d", (mask & ((1 << ch) - 1)) ? ',' : ' ', ch + 1);
+		if (last > ch) name += sprintf(name, "-%d", last + 1);
+		ch = last;
+	}
+}
+
+void open_seq(snd_seq_t** seq) 
+{
+	/* longest suffix is " ch 1,3,5,7,9,11,13,15"; port_name fits "MIDI out" plus all of suffix */
+	char port_name[64], suffix[48];
+	int g, ch;
 
 	if (snd_seq_open(seq, "default", SND_SEQ_OPEN_DUPLEX, 0) < 0) 
 	{
@@ -162,24 +418,90 @@ int open_seq(snd_seq_t** seq)
 
 	snd_seq_set_client_name(*seq, arguments.name);
 
-	if ((port_out_id = snd_seq_create_simple_port(*seq, "MIDI out",
-					SND_SEQ_PORT_CAP_READ|SND_SEQ_PORT_CAP_SUBS_READ,
-					SND_SEQ_PORT_TYPE_APPLICATION)) < 0) 
+	/* 
+	 * The client input pool sizes the kernel FIFO whose overflow shows up
+	 * as -ENOSPC in snd_seq_event_input(); the output pool bounds how many
+	 * of our events can be in flight. The input/output buffers are only
+	 * libasound's userspace read/write buffers. Failure is not fatal: we
+	 * simply keep running with the libasound defaults.
+	 */
+	if (arguments.pool_input > 0 && snd_seq_set_client_pool_input(*seq, arguments.pool_input) < 0)
+		fprintf(stderr, "Error setting ALSA client input pool to %i events.\n", arguments.pool_input);
+
+	if (arguments.pool_output > 0 && snd_seq_set_client_pool_output(*seq, arguments.pool_output) < 0)
+		fprintf(stderr, "Error setting ALSA client output pool to %i events.\n", arguments.pool_output);
+
+	if (arguments.input_buffer > 0 && snd_seq_set_input_buffer_size(*seq, arguments.input_buffer) < 0)
+		fprintf(stderr, "Error setting ALSA input buffer to %i bytes.\n", arguments.input_buffer);
+
+	if (arguments.output_buffer > 0 && snd_seq_set_output_buffer_size(*seq, arguments.output_buffer) < 0)
+		fprintf(stderr, "Error setting ALSA output buffer to %i bytes.\n", arguments.output_buffer);
+
+	if (arguments.ngroups == 0)
 	{
-		fprintf(stderr, "Error creating sequencer port.\n");
+		ngroups = 1;
+		group_mask[0] = (1 << MIDI_CHANNELS) - 1;
+	}
+	else
+	{
+		ngroups = arguments.ngroups;
+		memcpy(group_mask, arguments.channel_groups, sizeof(group_mask));
 	}
 
-	if ((port_in_id = snd_seq_create_simple_port(*seq, "MIDI in",
-					SND_SEQ_PORT_CAP_WRITE|SND_SEQ_PORT_CAP_SUBS_WRITE,
-					SND_SEQ_PORT_TYPE_APPLICATION)) < 0) 
+	for (g = 0; g < ngroups; g++)
 	{
-		fprintf(stderr, "Error creating sequencer port.\n");
+		for (ch = MIDI_CHANNELS - 1; ch >= 0; ch--)
+		{
+			if (!(group_mask[g] & (1 << ch))) continue;
+			channel_group[ch] = g;
+			group_first[g]    = ch;
+		}
+
+		/* 
+		 * Each event is sent only from its channel's port, so the
+		 * sequencer's subscriptions do the filtering for us.
+		 */
+		suffix[0] = 0;
+		if (arguments.ngroups > 0) group_port_suffix(group_mask[g], suffix);
+
+		snprintf(port_name, sizeof(port_name), "MIDI out%s", suffix);
+		if ((port_out_ids[g] = snd_seq_create_simple_port(*seq, port_name,
+						SND_SEQ_PORT_CAP_READ|SND_SEQ_PORT_CAP_SUBS_READ,
+						SND_SEQ_PORT_TYPE_APPLICATION)) < 0) 
+		{
+			fprintf(stderr, "Error creating sequencer port.\n");
+		}
+
+		snprintf(port_name, sizeof(port_name), "MIDI in%s", suffix);
+		if ((port_in_ids[g] = snd_seq_create_simple_port(*seq, port_name,
+						SND_SEQ_PORT_CAP_WRITE|SND_SEQ_PORT_CAP_SUBS_WRITE,
+						SND_SEQ_PORT_TYPE_APPLICATION)) < 0) 
+		{
+			fprintf(stderr, "Error creating sequencer port.\n");
+		}
 	}
+}
+
+void publish_event(int source, const char *bytes, int size)
+{
+	midiring_event_t ev;
+
+	if (ring == NULL) return;
+
+	ev.timestamp = midiring_now();
+	ev.source    = source;
+	ev.size      = size;
+	memcpy(ev.bytes, bytes, 3);
 
-	return port_out_id;
+	/* recheck under the lock, main() tears the ring down on exit */
+	pthread_mutex_lock(&ring_lock);
+	if (ring != NULL) midiring_publish(ring, &ev);
+	pthread_mutex_unlock(&ring_lock);
 }
 
-void parse_midi_command(snd_seq_t* seq, int port_out_id, char *buf)
+void write_midi_action_to_serial_port(snd_seq_t* seq_handle);
+
+void parse_midi_command(snd_seq_t* seq, char *buf)
 {
 	/*
 	   MIDI COMMANDS
@@ -211,16 +533,17 @@ void parse_midi_command(snd_seq_t* seq, int port_out_id, char *buf)
 	snd_seq_event_t ev;
 	snd_seq_ev_clear(&ev);
 	snd_seq_ev_set_direct(&ev);
-	snd_seq_ev_set_source(&ev, port_out_id);
 	snd_seq_ev_set_subs(&ev);
 
-	int operation, channel, param1, param2;
+	int operation, channel, param1, param2, err, tries = 0;
 
 	operation = buf[0] & 0xF0;
 	channel   = buf[0] & 0x0F;
 	param1    = buf[1];
 	param2    = buf[2];
 
+	snd_seq_ev_set_source(&ev, port_out_ids[channel_group[channel]]);
+
 	switch (operation)
 	{
 		case 0x80:
@@ -274,18 +597,121 @@ void parse_midi_command(snd_seq_t* seq, int port_out_id, char *buf)
 			break;
 	}
 
-	snd_seq_event_output_direct(seq, &ev);
+	if (operation >= 0x80 && operation < 0xF0)
+		publish_event(MIDIRING_FROM_SERIAL, buf, (operation == 0xC0 || operation == 0xD0) ? 2 : 3);
+
+	/* 
+	 * In busy-poll mode the sequencer is non-blocking, so wait for room
+	 * here. The pool may be full of events for our own "MIDI in" port,
+	 * and this is the only thread reading it, so keep draining that while
+	 * we wait. If there is still no room after a while, drop the event.
+	 */
+	while ((err = snd_seq_event_output_direct(seq, &ev)) == -EAGAIN && arguments.busy_poll && run &&
+	       ++tries < MAX_OUTPUT_RETRIES)
+	{
+		if (snd_seq_event_input_pending(seq, 1) > 0)
+			write_midi_action_to_serial_port(seq);
+	}
+
+	if (err >= 0 && serial_decoded)
+	{
+		uint64_t latency = midiring_now() - serial_decoded;
+		latency_count++;
+		latency_sum += latency;
+		if (latency > latency_max) latency_max = latency;
+	}
+	else if (err < 0)
+	{
+		/* the event is lost, but the serial stream carries on */
+		alsa_dropped++;
+		if (!arguments.silent)
+			fprintf(stderr, "Dropped MIDI event (%s), %lu so far\n", snd_strerror(err), alsa_dropped);
+	}
 	snd_seq_drain_output(seq);
 }
 
+/*
+ * Write a whole MIDI message, so a short write never leaves half of it on
+ * the wire. In busy-poll mode the serial port is non-blocking, so a full
+ * output buffer has to be waited out here instead of in write().
+ * Returns -1 if the device reported an error.
+ */
+int write_serial(int fd, const char *bytes, int size)
+{
+	int n;
+
+	while (size > 0)
+	{
+		n = write(fd, bytes, size);
+		if (n < 0 && (errno == EINTR || (errno == EAGAIN && arguments.busy_poll && run))) continue;
+		if (n <= 0) return -1;
+		bytes += n;
+		size  -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * Events arriving on a per-channel "MIDI in" port are forced onto that
+ * port's channel (or onto its group's first channel, if they are not
+ * already on one of the group's channels).
+ */
+void stamp_channel(snd_seq_event_t* ev)
+{
+	int g, ch;
+
+	/* only channel-voice events have a channel; leave everything else alone */
+	switch (ev->type)
+	{
+		case SND_SEQ_EVENT_NOTEOFF:
+		case SND_SEQ_EVENT_NOTEON:
+		case SND_SEQ_EVENT_KEYPRESS:
+		case SND_SEQ_EVENT_CONTROLLER:
+		case SND_SEQ_EVENT_PGMCHANGE:
+		case SND_SEQ_EVENT_CHANPRESS:
+		case SND_SEQ_EVENT_PITCHBEND:
+			break;
+		default:
+			return;
+	}
+
+	for (g = 0; g < ngroups && port_in_ids[g] != ev->dest.port; g++);
+	if (g == ngroups) return;
+
+	ch = ev->data.control.channel;
+	if (ch >= MIDI_CHANNELS || !(group_mask[g] & (1 << ch)))
+		ev->data.control.channel = group_first[g];
+}
+
 void write_midi_action_to_serial_port(snd_seq_t* seq_handle) 
 {
 	snd_seq_event_t* ev;
 	char bytes[] = {0x00, 0x00, 0xFF}; 
+	int err;
 
 	do 
 	{
-		snd_seq_event_input(seq_handle, &ev);
+		if ((err = snd_seq_event_input(seq_handle, &ev)) < 0)
+		{
+			/* 
+			 * -ENOSPC: the kernel input FIFO overran and has been flushed.
+			 * Events queued after the overrun are still delivered, so count
+			 * it and keep reading.
+			 */
+			if (err == -ENOSPC)
+			{
+				alsa_overruns++;
+				if (!arguments.silent)
+					fprintf(stderr, "ALSA input overrun, %lu so far\n", alsa_overruns);
+				continue;
+			}
+			if (err != -EAGAIN && !arguments.silent)
+				fprintf(stderr, "Error reading from ALSA: %s\n", snd_strerror(err));
+			break;
+		}
+
+		if (ngroups > 1) stamp_channel(ev);
 
 		switch (ev->type) 
 		{
@@ -359,11 +785,13 @@ void write_midi_action_to_serial_port(snd_seq_t* seq_handle)
       case SND_SEQ_EVENT_CONTROLLER: 
       case SND_SEQ_EVENT_PITCHBEND:
         bytes[2] = (bytes[2] & 0x7F);
-				write(serial, bytes, 3);
+				write_serial(serial, bytes, 3);
+				publish_event(MIDIRING_FROM_ALSA, bytes, 3);
         break;
       case SND_SEQ_EVENT_PGMCHANGE: 
       case SND_SEQ_EVENT_CHANPRESS:
-        write(serial, bytes, 2);
+        write_serial(serial, bytes, 2);
+        publish_event(MIDIRING_FROM_ALSA, bytes, 2);
         break;
     }
 
@@ -396,6 +824,92 @@ void* read_midi_from_alsa(void* seq)
 	printf("\nStopping [PC]->[Hardware] communication...");
 }
 
+/*
+ * Events from serial that pass the thru filter are written as-is to the
+ * thru device, and reach ALSA only with --thru-alsa (or when the thru
+ * write fails). Everything else goes to ALSA as usual.
+ */
+void route_midi_command(snd_seq_t* seq, char *buf)
+{
+	int operation = buf[0] & 0xF0;
+	int channel   = buf[0] & 0x0F;
+	int size      = (operation == 0xC0 || operation == 0xD0) ? 2 : 3;
+
+	if (thru_serial >= 0 && (arguments.thru_channels & (1 << channel)) && (arguments.thru_types & (1 << (operation >> 4))))
+	{
+		if (write_serial(thru_serial, buf, size) < 0)
+		{
+			/* don't lose the event: let it take the ALSA route instead */
+			thru_dropped++;
+			if (!arguments.silent)
+				fprintf(stderr, "Failed writing MIDI event to %s, %lu so far\n", arguments.thru, thru_dropped);
+			parse_midi_command(seq, buf);
+			return;
+		}
+
+		thru_forwarded++;
+		if (!arguments.silent && arguments.verbose) 
+			printf("Thru    0x%x                    %03u %03u %03u\n", operation, channel, buf[1], size > 2 ? buf[2] : 0);
+
+		if (!arguments.thru_alsa)
+		{
+			publish_event(MIDIRING_FROM_SERIAL, buf, size);
+			return;
+		}
+	}
+
+	parse_midi_command(seq, buf);
+}
+
+/*
+ * Read from the serial port. Normally this is just a blocking read().
+ *
+ * In busy-poll mode both the serial port and the sequencer are
+ * non-blocking, and this spins until len bytes have arrived, passing on
+ * ALSA events in between. After busy_spin idle polls it starts sleeping,
+ * from 1us doubling up to busy_sleep, and goes back to spinning as soon
+ * as anything arrives.
+ */
+int read_serial(snd_seq_t* seq, char *buf, int len)
+{
+	struct timespec pause;
+	long idle = 0, sleep_ns = 0;
+	int n, got = 0;
+
+	if (!arguments.busy_poll)
+		return read(serial, buf, len);
+
+	while (got < len)
+	{
+		if (!run) pthread_exit(NULL);
+
+		n = read(serial, buf + got, len - got);
+		if (n > 0)
+		{
+			got += n;
+			idle = sleep_ns = 0;
+			continue;
+		}
+
+		if (snd_seq_event_input_pending(seq, 1) > 0)
+		{
+			write_midi_action_to_serial_port(seq);
+			idle = sleep_ns = 0;
+			continue;
+		}
+
+		if (++idle < arguments.busy_spin || arguments.busy_sleep == 0) continue;
+
+		sleep_ns = sleep_ns ? sleep_ns * 2 : 1000;
+		if (sleep_ns > arguments.busy_sleep * 1000L) sleep_ns = arguments.busy_sleep * 1000L;
+		pause.tv_sec  = sleep_ns / 1000000000L;
+		pause.tv_nsec = sleep_ns % 1000000000L;
+		nanosleep(&pause, NULL);
+	}
+
+	return got;
+}
+
 void* read_midi_from_serial_port(void* seq) 
 {
 	char buf[3], msg[MAX_MSG_SIZE];
@@ -403,7 +917,7 @@ void* read_midi_from_serial_port(void* seq)
 	
 	/* Lets first fast forward to first status byte... */
 	if (!arguments.printonly) {
-		do read(serial, buf, 1);
+		do read_serial(seq, buf, 1);
 		while (buf[0] >> 7 == 0);
 	}
 
@@ -416,7 +930,7 @@ void* read_midi_from_serial_port(void* seq)
 
 		if (arguments.printonly) 
 		{
-			read(serial, buf, 1);
+			read_serial(seq, buf, 1);
 			printf("%x\t", (int) buf[0]&0xFF);
 			fflush(stdout);
 			continue;
@@ -429,7 +943,7 @@ void* read_midi_from_serial_port(void* seq)
 		int i = 1;
 
 		while (i < 3) {
-			read(serial, buf+i, 1);
+			read_serial(seq, buf+i, 1);
 
 			if (buf[i] >> 7 != 0) {
 				/* Status byte received and will always be first bit!*/
@@ -452,15 +966,16 @@ void* read_midi_from_serial_port(void* seq)
 			}
 
 		}
+		serial_decoded = midiring_now();
 
 		/* print comment message (the ones that start with 0xFF 0x00 0x00 */
 		if (buf[0] == (char) 0xFF && buf[1] == (char) 0x00 && buf[2] == (char) 0x00)
 		{
-			read(serial, buf, 1);
+			read_serial(seq, buf, 1);
 			msglen = buf[0];
 			if (msglen > MAX_MSG_SIZE-1) msglen = MAX_MSG_SIZE-1;
 
-			read(serial, msg, msglen);
+			read_serial(seq, msg, msglen);
 
 			if (arguments.silent) continue;
 
@@ -474,45 +989,59 @@ void* read_midi_from_serial_port(void* seq)
 		}
 
 		/* parse MIDI message */
-		else parse_midi_command(seq, port_out_id, buf);
+		else route_midi_command(seq, buf);
 	}
 }
 
-/* --------------------------------------------------------------------- */
-// Main program
-
-main(int argc, char** argv)
+/*
+ * The single thread of busy-poll mode: serves both the serial port and
+ * the sequencer from read_serial(), optionally pinned to one CPU.
+ */
+void* busy_poll_midi(void* seq) 
 {
-	//arguments arguments;
-	struct termios oldtio, newtio;
-	struct serial_struct ser_info;
-	char* modem_device = "/dev/ttyS0";
-	snd_seq_t *seq;
+	cpu_set_t cpus;
+	sigset_t sigs;
 
-	arg_set_defaults(&arguments);
-	argp_parse(&argp, argc, argv, 0, 0, &arguments);
+	/* leave SIGINT/SIGTERM to the main thread */
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &sigs, NULL);
 
-	/*
-	 * Open MIDI output port
-	 */
+	if (arguments.busy_cpu >= 0)
+	{
+		CPU_ZERO(&cpus);
+		CPU_SET(arguments.busy_cpu, &cpus);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+			fprintf(stderr, "Error pinning busy-poll thread to CPU %i.\n", arguments.busy_cpu);
+	}
 
-	port_out_id = open_seq(&seq);
+	return read_midi_from_serial_port(seq);
+}
 
-	/* 
-	 *  Open modem device for reading and not as controlling tty because we don't
-	 *  want to get killed if linenoise sends CTRL-C.
-	 */
-	
-	serial = open(arguments.serialdevice, O_RDWR | O_NOCTTY ); 
+/* --------------------------------------------------------------------- */
+// Serial port
+
+/*
+ * Open a serial device raw at the configured baud rate. The previous
+ * settings are saved in oldtio so they can be restored on exit.
+ */
+int open_serial(const char *device, struct termios *oldtio)
+{
+	int fd;
+	struct termios newtio;
+	struct serial_struct ser_info;
+
+	fd = open(device, O_RDWR | O_NOCTTY ); 
 
-	if (serial < 0) 
+	if (fd < 0) 
 	{
-		perror(arguments.serialdevice); 
+		perror(device); 
 		exit(-1); 
 	}
 
 	/* save current serial port settings */
-	tcgetattr(serial, &oldtio); 
+	tcgetattr(fd, oldtio); 
 
 	/* clear struct for new port settings */
 	bzero(&newtio, sizeof(newtio)); 
@@ -553,19 +1082,71 @@ main(int argc, char** argv)
 	/* 
 	 * now clean the modem line and activate the settings for the port
 	 */
-	tcflush(serial, TCIFLUSH);
-	tcsetattr(serial, TCSANOW, &newtio);
+	tcflush(fd, TCIFLUSH);
+	tcsetattr(fd, TCSANOW, &newtio);
 
 	// Linux-specific: enable low latency mode (FTDI "nagling off")
-//	ioctl(serial, TIOCGSERIAL, &ser_info);
+//	ioctl(fd, TIOCGSERIAL, &ser_info);
 //	ser_info.flags |= ASYNC_LOW_LATENCY;
-//	ioctl(serial, TIOCSSERIAL, &ser_info);
+//	ioctl(fd, TIOCSSERIAL, &ser_info);
+
+	return fd;
+}
+
+/* --------------------------------------------------------------------- */
+// Main program
+
+main(int argc, char** argv)
+{
+	//arguments arguments;
+	struct termios oldtio, thru_oldtio;
+	char* modem_device = "/dev/ttyS0";
+	snd_seq_t *seq;
+
+	arg_set_defaults(&arguments);
+	argp_parse(&argp, argc, argv, 0, 0, &arguments);
+
+	/*
+	 * Open MIDI output port
+	 */
+
+	open_seq(&seq);
+
+	/*
+	 * Open shared-memory event ring for local readers
+	 */
+
+	if (arguments.shm[0])
+	{
+		ring = midiring_create(arguments.shm, arguments.shm_size);
+		if (ring == NULL)
+		{
+			perror(arguments.shm);
+			exit(1);
+		}
+	}
+
+	/* 
+	 *  Open modem device for reading and not as controlling tty because we don't
+	 *  want to get killed if linenoise sends CTRL-C.
+	 */
+	
+	serial = open_serial(arguments.serialdevice, &oldtio);
+
+	if (arguments.thru[0])
+		thru_serial = open_serial(arguments.thru, &thru_oldtio);
 
 	if (arguments.printonly) 
 	{
 		printf("Super debug mode: Only printing the signal to screen. Nothing else.\n");
 	}
 
+	if (arguments.busy_poll)
+	{
+		fcntl(serial, F_SETFL, fcntl(serial, F_GETFL) | O_NONBLOCK);
+		snd_seq_nonblock(seq, 1);
+	}
+
 	/* 
 	 * read commands
 	 */
@@ -574,11 +1155,19 @@ main(int argc, char** argv)
 	pthread_t midi_out_thread, midi_in_thread;
 	int iret1, iret2;
 	run = TRUE;
-	iret1 = pthread_create(&midi_out_thread, NULL, read_midi_from_alsa, (void*) seq);
-	/* And also thread for polling serial data. As serial is currently read in
-           blocking mode, by this we can enable ctrl+c quiting and avoid zombie
-           alsa ports when killing app with ctrl+z */
-	iret2 = pthread_create(&midi_in_thread, NULL, read_midi_from_serial_port, (void*) seq);
+	if (arguments.busy_poll)
+	{
+		/* One spinning thread does both directions */
+		iret1 = pthread_create(&midi_out_thread, NULL, busy_poll_midi, (void*) seq);
+	}
+	else
+	{
+		iret1 = pthread_create(&midi_out_thread, NULL, read_midi_from_alsa, (void*) seq);
+		/* And also thread for polling serial data. As serial is currently read in
+	           blocking mode, by this we can enable ctrl+c quiting and avoid zombie
+	           alsa ports when killing app with ctrl+z */
+		iret2 = pthread_create(&midi_in_thread, NULL, read_midi_from_serial_port, (void*) seq);
+	}
 	signal(SIGINT, exit_cli);
 	signal(SIGTERM, exit_cli);
 
@@ -592,6 +1181,25 @@ main(int argc, char** argv)
 
 	/* restore the old port settings */
 	tcsetattr(serial, TCSANOW, &oldtio);
+	if (thru_serial >= 0)
+		tcsetattr(thru_serial, TCSANOW, &thru_oldtio);
+
+	if (ring != NULL)
+	{
+		pthread_mutex_lock(&ring_lock);
+		midiring_destroy(ring, arguments.shm);
+		ring = NULL;
+		pthread_mutex_unlock(&ring_lock);
+	}
+
+	if (!arguments.silent && (alsa_overruns || alsa_dropped))
+		printf("\nALSA input overruns: %lu, dropped output events: %lu", alsa_overruns, alsa_dropped);
+	if (!arguments.silent && thru_serial >= 0)
+		printf("\nEvents forwarded to %s: %lu, failed: %lu", arguments.thru, thru_forwarded, thru_dropped);
+	if (!arguments.silent && latency_count)
+		printf("\nDecode to ALSA latency (%s): avg %.1f us, max %.1f us over %lu events",
+			arguments.busy_poll ? "busy-poll" : "blocking",
+			latency_sum / (double) latency_count / 1000.0, latency_max / 1000.0, latency_count);
 	printf("\ndone!\n");
 }
 